@@ -0,0 +1,130 @@
+"""
+This module generates an EEPROM image (CVs, CV checksum and initial function state) from a per-car profile and
+adds it to the upload command, so that a car is fully provisioned with a single flash command
+
+The profile is selected with the custom_car_profile option in platformio.ini or the CAR_PROFILE environment variable:
+    CAR_PROFILE=profiles/example.ini pio run -t upload
+Without profile, nothing is generated and the EEPROM is left erased (factory reset at first boot)
+
+The CV table (CV numbers, default values and EEPROM layout) is read from src/main.cpp, so that it does not have
+to be maintained in two places
+
+The atmelmegaavr builder replaces UPLOADERFLAGS when it sets up avrdude, so the EEPROM flag is added by a pre-upload
+action of this post: script, right before the upload command is run. Check the final avrdude command line with
+    CAR_PROFILE=profiles/example.ini pio run -t upload -v
+"""
+
+import configparser
+import os
+import re
+
+Import("env")
+
+FILENAME_MAIN_CPP = 'src/main.cpp'
+FILENAME_EEPROM_HEX = 'eeprom.hex'
+EEPROM_SIZE = 256
+
+# Function groups as defined by NmraDcc (FN_GROUP): FN_0_4 = 1, FN_5_8, FN_9_12, FN_13_20, FN_21_28, FN_LAST
+NUMBER_OF_FUNCTION_GROUPS = 6
+FCTS_EEPROM_ADDRESS = EEPROM_SIZE - NUMBER_OF_FUNCTION_GROUPS
+
+
+def search(pattern, src, what, flags=0):
+    """re.search() that raises a clear error if the pattern is not found in src/main.cpp"""
+    m = re.search(pattern, src, flags)
+    if m is None:
+        raise ValueError('Cannot find {} in {}'.format(what, FILENAME_MAIN_CPP))
+    return m
+
+
+def read_cv_table(filename):
+    """Return the EEPROM address of the CVs and the list of (cvNr, applyDefault, writable, defaultValue) from cvData[]"""
+    with open(filename, encoding="utf-8") as f:
+        src = f.read()
+    cv_eeprom_address = int(search(r'const uint8_t cvEepromAddress = (\d+);', src, 'cvEepromAddress').group(1))
+    table = search(r'const struct cvStruct cvData\[\] =\s*\{(.*?)\n\};', src, 'cvData[]', re.S).group(1)
+    cvs = []
+    for m in re.finditer(r'\{\s*cv\w+,\s*(\d+),\s*(true|false),\s*(true|false),\s*(\d+)\s*\}', table):
+        cvs.append((int(m.group(1)), m.group(2) == 'true', m.group(3) == 'true', int(m.group(4))))
+    # A row that is not parsed would shift all the following CVs in EEPROM, and the checksum would hide it
+    nr_rows = len(re.findall(r'\{\s*cv\w+', table))
+    if len(cvs) != nr_rows:
+        raise ValueError('Only {} of the {} rows of cvData[] could be parsed in {}'.format(len(cvs), nr_rows, filename))
+    return cv_eeprom_address, cvs
+
+
+def function_state(functions_on):
+    """Return funcCache[] with the given function numbers (0..28) ON, using the NmraDcc FN_BIT_xx layout"""
+    func_cache = [0] * NUMBER_OF_FUNCTION_GROUPS
+    for fn in functions_on:
+        if fn == 0:
+            func_cache[1] |= 0x10
+        elif fn <= 4:
+            func_cache[1] |= 1 << (fn - 1)
+        elif fn <= 8:
+            func_cache[2] |= 1 << (fn - 5)
+        elif fn <= 12:
+            func_cache[3] |= 1 << (fn - 9)
+        elif fn <= 20:
+            func_cache[4] |= 1 << (fn - 13)
+        elif fn <= 28:
+            func_cache[5] |= 1 << (fn - 21)
+        else:
+            raise ValueError('Function F{} out of range (F0 to F28)'.format(fn))
+    return func_cache
+
+
+def build_image(profile_filename):
+    cv_eeprom_address, cvs = read_cv_table(FILENAME_MAIN_CPP)
+    profile = configparser.ConfigParser(inline_comment_prefixes=(';', '#'))
+    if not profile.read(profile_filename, encoding="utf-8"):
+        raise FileNotFoundError(profile_filename)
+
+    # Start from the factory defaults, then apply the CVs of the profile
+    values = {cv_nr: (default if apply_default else 0) for cv_nr, apply_default, _, default in cvs}
+    writable = {cv_nr: cv_writable for cv_nr, _, cv_writable, _ in cvs}
+    if profile.has_section('cv'):
+        for cv_nr, value in profile.items('cv'):
+            cv_nr, value = int(cv_nr), int(value, 0)
+            if cv_nr not in values:
+                raise ValueError('Unknown CV{} in {}'.format(cv_nr, profile_filename))
+            if not writable[cv_nr]:
+                raise ValueError('CV{} is read only and cannot be set in {}'.format(cv_nr, profile_filename))
+            if not 0 <= value <= 255:
+                raise ValueError('CV{} value {} out of range in {}'.format(cv_nr, value, profile_filename))
+            values[cv_nr] = value
+
+    image = [0xFF] * EEPROM_SIZE
+    for i, (cv_nr, _, _, _) in enumerate(cvs[:-1]):
+        image[cv_eeprom_address + i] = values[cv_nr]
+    # The last CV is the checksum of all other CVs (sum modulo 256)
+    image[cv_eeprom_address + len(cvs) - 1] = sum(image[cv_eeprom_address:cv_eeprom_address + len(cvs) - 1]) % 256
+
+    functions_on = []
+    if profile.has_option('functions', 'on'):
+        functions_on = [int(fn) for fn in profile.get('functions', 'on').replace(',', ' ').split()]
+    image[FCTS_EEPROM_ADDRESS:] = function_state(functions_on)
+    return image
+
+
+def write_intel_hex(filename, data):
+    with open(filename, 'w', encoding="utf-8") as f:
+        for address in range(0, len(data), 16):
+            record = [16, address >> 8, address & 0xFF, 0x00] + data[address:address + 16]
+            checksum = (-sum(record)) & 0xFF
+            f.write(':' + ''.join('{:02X}'.format(b) for b in record + [checksum]) + '\n')
+        f.write(':00000001FF\n')
+
+
+def add_eeprom_upload_flag(source, target, env):
+    env.Append(UPLOADERFLAGS=['-Ueeprom:w:{}:i'.format(hex_filename)])
+    print('[EEPROM script] Upload command: {}'.format(env.subst('$UPLOADCMD')))
+
+
+profile_filename = os.environ.get('CAR_PROFILE') or env.GetProjectOption('custom_car_profile', '')
+if profile_filename:
+    hex_filename = os.path.join(env.subst('$BUILD_DIR'), FILENAME_EEPROM_HEX)
+    os.makedirs(os.path.dirname(hex_filename), exist_ok=True)
+    write_intel_hex(hex_filename, build_image(profile_filename))
+    print('[EEPROM script] Profile = {} -> {}'.format(profile_filename, hex_filename))
+    env.AddPreAction('upload', add_eeprom_upload_flag)
@@ -24,6 +24,10 @@ Hardware resources
     - Uses the INT0/1 Hardware Interrupt and micros() ONLY
     - On the ATtiny1616, millis() and micros() use TCD0
 
+- TCB1
+    - Used only by the self-benchmark (CV1020), as a free-running 16-bit counter clocked at CLK_PER/2
+      (0.2us per tick at 10MHz). It is stopped when the benchmark is finished
+
 - EEPROM
     - The ATtiny1616 EEPROM size is 256 bytes, with addresses ranging from 0 to 255
     - By default, NmraDcc uses the EEPROM to store CVs. CVs are stored at the location corresponding to the CV number
@@ -33,6 +37,13 @@ Hardware resources
       at any address in EEPROM
     - We will also use locations 250-255 to store the status of the functions (F0 to F28). The goal is to have the lights
       in the correct state at power on, before the decoder receives any DCC packet setting these functions
+    - The EEPROM is mapped in the data space (MAPPED_EEPROM_START) and can be read at normal load speed. CVs are therefore
+      read directly from the mapped EEPROM, without any copy in RAM. Only the CV writes not yet committed to EEPROM are
+      held in RAM, in a small dirty overlay (cvOverlay[]), which is committed one CV at a time from loop() when the
+      EEPROM is not busy
+    - Reading the mapped EEPROM during an erase/write stalls the CPU, including the DCC input interrupt, for the whole
+      cycle (~4ms). The EEPROM is therefore never read while NVMCTRL_EEBUSY is set: cvValue() polls NVMCTRL.STATUS,
+      which keeps the interrupts running, and loop() skips its CV checks while the EEPROM is busy
 
 CV Map
 CV1     Primary Address
@@ -67,6 +78,51 @@ CV1005  Light Function control Set 2
 CV1010  Light Test
           0: CV1000/CV1001 contain light brightness and CCT (default)
           1: CV1000/CV1001 contain Warm White Luminance and Cool White Luminance (used for testing)
+CV1012  Track Voltage of the layout, in units of 0.1V (0..255), for the Track Voltage Compensation
+          0: compensation disabled, the PWM duty cycle does not depend on the track voltage (default)
+          160: the layout runs at 16.0V. The PWM duty cycle is scaled so that the light brightness is the one
+               obtained at compensationReferenceMv (14.0V), so that the same brightness CVs can be used on all layouts
+CV1013  Function State Persist Repeats (0..255)
+          Number of consistent repeats of a DCC function packet required before a function change is stored in EEPROM.
+          Function changes are always applied immediately to the lights. This filters corrupted packets on noisy track
+          0: the function state is stored at the first packet
+          3: (default)
+CV1014  Function State Persist Delay, in units of 100ms (0..255)
+          A function change is also stored in EEPROM when it has been stable for this delay, even without repeats
+          0: no delay, only CV1013 applies
+          20: 2 seconds (default)
+CV1020  Self-Benchmark
+          0: no benchmark (default)
+          1: run the self-benchmark. The results are stored in CV1021 to CV1030 and CV1020 is reset to 0
+CV1021+1022  Benchmark: CV lookup, worst case (MSB, LSB) (read only)
+CV1023+1024  Benchmark: updateLights() (MSB, LSB) (read only)
+CV1025+1026  Benchmark: EEPROM write, including the erase/write cycle (MSB, LSB) (read only)
+CV1027+1028  Benchmark: function packet dispatch, synthetic packet repeating the current state (MSB, LSB) (read only)
+CV1029+1030  Benchmark: function packet dispatch, synthetic packet changing the state (MSB, LSB) (read only)
+          All benchmark results are in TCB1 ticks of 0.2us (at 10MHz). The CV lookup, updateLights() and packet dispatch
+          results are the minimum of benchmarkRuns runs, to filter the interrupts. The serial debug messages are
+          suppressed during the timed runs, and the function state is never stored in EEPROM by the benchmark
+          The benchmark is not run in address learning mode
+CV1040  Address Learning
+          0: disabled (default)
+          1: learning mode armed now
+          2: learning mode armed by the power up pattern: the learning function (CV1041) toggled from OFF to ON
+             addressLearnArmToggles (3) times on the current address of the decoder, within addressLearnArmWindowMs
+             (10s) after power up
+          In learning mode, the decoder adopts the address of the first multifunction packet toggling the learning
+          function from OFF to ON, writes it to CV1 (short address) or CV17/18 (long address) and CV29, and leaves
+          the learning mode. Without any toggle, the learning mode ends after addressLearnTimeoutMs (60s)
+          When the learning mode ends, CV1040 = 1 is reset to 0, so that the address is committed only once
+          While in learning mode, function packets do not change the lights and CV writes are ignored, as the decoder
+          receives the packets for all addresses, including the operations mode CV writes to other decoders
+          Addresses with the learning function already ON are recorded during the first addressLearnSettleMs (3s)
+          of the learning mode and are not learnt until they switch the function OFF then ON again. At most
+          addressLearnTableSize (8) such addresses can be recorded: with more addresses having the learning function
+          ON, or addresses not refreshed by the command station within 3s, the wrong address may be learnt
+CV1041  Address Learning Function
+          0: F0
+          ...
+          28: F28 (default)
 \*************************************************************************************************************/
 
 #include <Arduino.h>
@@ -85,6 +141,16 @@ const uint8_t warmWhiteLight = 0;
 const uint8_t coolWhiteLight = 1;
 const pin_size_t pinDCCInput = PIN_PA2;
 
+// Track voltage compensation
+// The LEDs are supplied by the rectified track voltage through their series resistors, so their current, and
+// hence their luminance, is proportional to (track voltage - LED forward voltage). The PWM duty cycle is scaled by
+// voltageFactor = (reference voltage - LED Vf) / (track voltage - LED Vf), a fixed-point value where 256 = 1.0
+// The board has no track voltage sense input, so the track voltage of the layout is set in CV1012
+const uint16_t compensationReferenceMv = 14000;   // Track voltage at which the brightness CVs are calibrated
+const uint16_t ledForwardVoltageMv = 3000;        // Forward voltage of the 3014 LEDs
+const uint16_t maxVoltageFactor = 512;            // Limit the correction to x2
+uint16_t voltageFactor = 256;                     // Current correction factor applied to the PWM duty cycle
+
 // Objects from NmraDcc
 NmraDcc dcc;
 
@@ -93,6 +159,12 @@ NmraDcc dcc;
 const uint8_t numberOfFunctionGroups = FN_LAST;
 const uint8_t numberOfFunctions = 29;
 uint8_t funcCache[numberOfFunctionGroups] = {0, 0, 0, 0, 0, 0};
+// funcPersisted[] holds the state of the functions as stored in EEPROM. A change in funcCache[] is only written to EEPROM
+// after it has been confirmed by funcRepeatCount[] consistent packets (CV1013) or has been stable since
+// funcChangeTime[] for CV1014
+uint8_t funcPersisted[numberOfFunctionGroups] = {0, 0, 0, 0, 0, 0};
+uint8_t funcRepeatCount[numberOfFunctionGroups] = {0, 0, 0, 0, 0, 0};
+uint32_t funcChangeTime[numberOfFunctionGroups] = {0, 0, 0, 0, 0, 0};
 const uint8_t funcBitMask[numberOfFunctions] = {FN_BIT_00, FN_BIT_01, FN_BIT_02, FN_BIT_03, FN_BIT_04,
                                                 FN_BIT_05, FN_BIT_06, FN_BIT_07, FN_BIT_08,
                                                 FN_BIT_09, FN_BIT_10, FN_BIT_11, FN_BIT_12,
@@ -112,7 +184,6 @@ struct cvStruct
     bool applyDefault;      // True if the default value must be applied after a Factory Reset
     bool writable;          // True if the CV can be written. False if the CV is read only
     uint8_t defaultValue;   // Default value applied at first power on or after a Factory Reset
-    uint8_t value;          // Current value cached in RAM
 };
 
 // Enum of all CVs, assigning them with their index number. This index is also the address in
@@ -132,26 +203,58 @@ enum cvIndex
     cvLightColorTemperature2,
     cvLightFctCtrl2,
     cvLightTest,
+    cvTrackVoltage,
+    cvFuncPersistRepeats,
+    cvFuncPersistDelay,
+    cvBenchmark,
+    cvBenchmarkCVLookupMSB,
+    cvBenchmarkCVLookupLSB,
+    cvBenchmarkUpdateLightsMSB,
+    cvBenchmarkUpdateLightsLSB,
+    cvBenchmarkEepromWriteMSB,
+    cvBenchmarkEepromWriteLSB,
+    cvBenchmarkPacketDispatchMSB,
+    cvBenchmarkPacketDispatchLSB,
+    cvBenchmarkPacketChangeMSB,
+    cvBenchmarkPacketChangeLSB,
+    cvAddressLearn,
+    cvAddressLearnFct,
     cvChecksum
 };
 
-struct cvStruct cvData[] =
-{
-//   cvIndex,        cvNr,applyDefault,writable,defaultValue,value 
-    {cvPrimaryAddress, 1, true, true, 3, 0},
-    {cvManufacturerVersionNumber, 7, false, false, 0, 0},
-    {cvManufacturerIDNumber, 8, false, false, 0, 0},
-    {cvExtendedAddressMSB, 17, true, true, 0, 0},
-    {cvExtendedAddressLSB, 18, true, true, 0, 0},
-    {cvModeControl, 29, true, true, 2, 0}, 
-    {cvLightBrightness, 1000, true, true, 50, 0},
-    {cvLightColorTemperature, 1001, true, true, 255, 0},
-    {cvLightFctCtrl, 1002, true, true, 1, 0},
-    {cvLightBrightness2, 1003, true, true, 30, 0},
-    {cvLightColorTemperature2, 1004, true, true, 255, 0},
-    {cvLightFctCtrl2, 1005, true, true, 10, 0},
-    {cvLightTest, 1010, true, true, 0, 0},
-    {cvChecksum, 1011, false, false, 0, 0}
+const struct cvStruct cvData[] =
+{
+//   cvIndex,        cvNr,applyDefault,writable,defaultValue
+    {cvPrimaryAddress, 1, true, true, 3},
+    {cvManufacturerVersionNumber, 7, false, false, 0},
+    {cvManufacturerIDNumber, 8, false, false, 0},
+    {cvExtendedAddressMSB, 17, true, true, 0},
+    {cvExtendedAddressLSB, 18, true, true, 0},
+    {cvModeControl, 29, true, true, 2}, 
+    {cvLightBrightness, 1000, true, true, 50},
+    {cvLightColorTemperature, 1001, true, true, 255},
+    {cvLightFctCtrl, 1002, true, true, 1},
+    {cvLightBrightness2, 1003, true, true, 30},
+    {cvLightColorTemperature2, 1004, true, true, 255},
+    {cvLightFctCtrl2, 1005, true, true, 10},
+    {cvLightTest, 1010, true, true, 0},
+    {cvTrackVoltage, 1012, true, true, 0},
+    {cvFuncPersistRepeats, 1013, true, true, 3},
+    {cvFuncPersistDelay, 1014, true, true, 20},
+    {cvBenchmark, 1020, true, true, 0},
+    {cvBenchmarkCVLookupMSB, 1021, false, false, 0},
+    {cvBenchmarkCVLookupLSB, 1022, false, false, 0},
+    {cvBenchmarkUpdateLightsMSB, 1023, false, false, 0},
+    {cvBenchmarkUpdateLightsLSB, 1024, false, false, 0},
+    {cvBenchmarkEepromWriteMSB, 1025, false, false, 0},
+    {cvBenchmarkEepromWriteLSB, 1026, false, false, 0},
+    {cvBenchmarkPacketDispatchMSB, 1027, false, false, 0},
+    {cvBenchmarkPacketDispatchLSB, 1028, false, false, 0},
+    {cvBenchmarkPacketChangeMSB, 1029, false, false, 0},
+    {cvBenchmarkPacketChangeLSB, 1030, false, false, 0},
+    {cvAddressLearn, 1040, true, true, 0},
+    {cvAddressLearnFct, 1041, true, true, 28},
+    {cvChecksum, 1011, false, false, 0}
 };
 
 const uint8_t nrCVs = sizeof(cvData) / sizeof(cvStruct);
@@ -163,20 +266,104 @@ const uint8_t fctsEepromAddress = 255 - numberOfFunctionGroups + 1;
 // of the EEPROM (away from zero, which is more sensitive to corruption?)
 const uint8_t cvEepromAddress = 32;
 
+// Dirty overlay holding the CV writes not yet committed to EEPROM, oldest first
+// cvOverlayWriting is true while the EEPROM write of cvOverlay[0] is in progress
+struct cvOverlayStruct
+{
+    uint8_t cvIndex;
+    uint8_t value;
+};
+const uint8_t cvOverlaySize = 8;
+struct cvOverlayStruct cvOverlay[cvOverlaySize];
+uint8_t cvOverlayCount = 0;
+bool cvOverlayWriting = false;
+
+inline bool eepromBusy()
+{
+    return NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm;
+}
+
+// Wait for the end of an EEPROM erase/write before reading the EEPROM. Polling NVMCTRL.STATUS keeps the interrupts
+// running, whereas reading the mapped EEPROM while it is busy would stall the CPU
+inline void waitEepromReady()
+{
+    while (eepromBusy())
+        ;
+}
+
+// Return the current value of a CV: from the overlay if a write is pending, else directly from the mapped EEPROM
+inline uint8_t cvValue(uint8_t index)
+{
+    for (uint8_t j = 0; j < cvOverlayCount; j++)
+        if (cvOverlay[j].cvIndex == index)
+            return cvOverlay[j].value;
+    waitEepromReady();
+    return *(const volatile uint8_t *)(MAPPED_EEPROM_START + cvEepromAddress + index);
+}
+
+// Commit the oldest pending CV write to EEPROM, if the EEPROM is not busy. Called from loop()
+void commitCVOverlay()
+{
+    if (eepromBusy())
+        return;
+    if (cvOverlayWriting)                                   // The write of cvOverlay[0] is finished: remove it
+    {
+        cvOverlayWriting = false;
+        cvOverlayCount--;
+        for (uint8_t j = 0; j < cvOverlayCount; j++)
+            cvOverlay[j] = cvOverlay[j + 1];
+    }
+    if (cvOverlayCount)
+    {
+        EEPROM.write(cvEepromAddress + cvOverlay[0].cvIndex, cvOverlay[0].value);
+        cvOverlayWriting = true;
+    }
+}
+
+// Commit all pending CV writes to EEPROM
+void flushCVOverlay()
+{
+    while (cvOverlayCount)
+        commitCVOverlay();
+}
+
+// Set the value of a CV. The value is held in the overlay until it is committed to EEPROM
+void setCVValue(uint8_t index, uint8_t value)
+{
+    for (uint8_t j = 0; j < cvOverlayCount; j++)
+    {
+        if (cvOverlay[j].cvIndex == index)
+        {
+            cvOverlay[j].value = value;
+            if (j == 0)
+                cvOverlayWriting = false;                   // Write it again if the write is in progress
+            return;
+        }
+    }
+    while (cvOverlayCount == cvOverlaySize)                 // Overlay full: wait for the oldest write
+        commitCVOverlay();
+    cvOverlay[cvOverlayCount].cvIndex = index;
+    cvOverlay[cvOverlayCount].value = value;
+    cvOverlayCount++;
+}
+
 void updateLights();
+void updateVoltageFactor();
+extern bool benchmarkRunning;
+uint8_t notifyCVWrite(uint16_t CV, uint8_t Value);
+void initDcc();
 
 #ifdef DEBUG
 // Compute and store as the last CV the checksum of all other CVs
 // The checksum is computed
 // - as the sum of all CVs modulo 256
-// - on the cached values cvData[].value, not the values stored in EEPROM
+// - on the current values, including the writes pending in the overlay
 void updateCvChecksum()
 {
     uint8_t i, total = 0;
     for (i = 0; i < nrCVs-1; i++)
-        total += cvData[i].value;
-    cvData[i].value = total;
-    EEPROM.update(i + cvEepromAddress, total);
+        total += cvValue(i);
+    setCVValue(i, total);
 }
 
 // Check that the CV checksum is correct. Return true is correct, false if incorrect
@@ -184,8 +371,8 @@ bool checkCvChecksum()
 {
     uint8_t i, total = 0;
     for (i = 0; i < nrCVs-1; i++)
-        total += cvData[i].value;
-    return (total == cvData[i].value);
+        total += cvValue(i);
+    return (total == cvValue(i));
 }
 #endif
 
@@ -213,24 +400,181 @@ void notifyCVResetFactoryDefault()
     factoryDefaultCVIndex = nrCVs;
 };
 
+// Store the state of a function group in EEPROM
+void persistFuncGroup(uint8_t funcGrp)
+{
+    if (benchmarkRunning)
+        return;
+#ifdef DEBUG
+    Serial.print("Persist Function Group: ");
+    Serial.print(funcGrp);
+    Serial.print("|State = 0b");
+    Serial.println(funcCache[funcGrp], BIN);
+#endif
+    waitEepromReady();                                  // EEPROM.update() reads the EEPROM
+    EEPROM.update(fctsEepromAddress + funcGrp, funcCache[funcGrp]);
+    funcPersisted[funcGrp] = funcCache[funcGrp];
+}
+
+// Address learning
+// In learning mode, the decoder receives the function packets of all addresses. The addresses having the learning
+// function ON are recorded in addressLearnOnAddr[] (0 = free entry) during the first addressLearnSettleMs, then the
+// first address switching the learning function ON that is not recorded is learnt
+const uint8_t addressLearnTableSize = 8;
+const uint16_t addressLearnSettleMs = 3000;
+const uint16_t addressLearnTimeoutMs = 60000;
+const uint8_t addressLearnArmToggles = 3;
+const uint16_t addressLearnArmWindowMs = 10000;
+bool addressLearnMode = false;
+bool addressLearnArmRequest = false;                    // Set by the power up pattern, learning started from loop()
+bool dccReinitPending = false;                          // Set when the learning mode ends, initDcc() from loop()
+uint16_t addressLearnOnAddr[addressLearnTableSize];
+uint32_t addressLearnStartTime;
+uint8_t addressLearnArmCount = 0;
+
+// Called from loop() only, as it re-initializes NmraDcc
+void startAddressLearning()
+{
+#ifdef DEBUG
+    Serial.println("Address learning started");
+#endif
+    addressLearnMode = true;
+    addressLearnArmRequest = false;
+    addressLearnStartTime = millis();
+    for (uint8_t i = 0; i < addressLearnTableSize; i++)
+        addressLearnOnAddr[i] = 0;
+    initDcc();                                          // Receive the packets for all addresses
+}
+
+// Leave the learning mode. NmraDcc is re-initialized later from loop(), as this may be called from dcc.process()
+void endAddressLearning()
+{
+    addressLearnMode = false;
+    if (cvValue(cvAddressLearn) == 1)              // Armed by CV1040: the address is committed only once
+        notifyCVWrite(cvData[cvAddressLearn].cvNr, 0);
+    dccReinitPending = true;
+}
+
+// Write the learnt address to the address CVs and leave the learning mode
+void commitLearntAddress(uint16_t Addr, DCC_ADDR_TYPE AddrType)
+{
+#ifdef DEBUG
+    Serial.print("Address learnt: ");
+    Serial.println(Addr);
+#endif
+    addressLearnMode = false;                           // Allow the CV writes below
+    if (AddrType == DCC_ADDR_SHORT)
+    {
+        notifyCVWrite(cvData[cvPrimaryAddress].cvNr, Addr);
+        notifyCVWrite(cvData[cvModeControl].cvNr, cvValue(cvModeControl) & ~CV29_EXT_ADDRESSING);
+    }
+    else
+    {
+        notifyCVWrite(cvData[cvExtendedAddressMSB].cvNr, 0xC0 | (Addr >> 8));
+        notifyCVWrite(cvData[cvExtendedAddressLSB].cvNr, Addr & 0xFF);
+        notifyCVWrite(cvData[cvModeControl].cvNr, cvValue(cvModeControl) | CV29_EXT_ADDRESSING);
+    }
+    endAddressLearning();
+}
+
+// Process a function packet in learning mode. Commit the address if the learning function toggles from OFF to ON
+void learnAddress(uint16_t Addr, DCC_ADDR_TYPE AddrType, FN_GROUP FuncGrp, uint8_t FuncState)
+{
+    uint8_t learnFct = cvValue(cvAddressLearnFct);
+    if (Addr == 0 || learnFct >= numberOfFunctions || FuncGrp != funcGroup[learnFct])
+        return;
+
+    bool fctOn = FuncState & funcBitMask[learnFct];
+    uint8_t i, freeEntry = addressLearnTableSize;
+    for (i = 0; i < addressLearnTableSize; i++)
+    {
+        if (addressLearnOnAddr[i] == Addr)
+            break;
+        if (addressLearnOnAddr[i] == 0)
+            freeEntry = i;
+    }
+
+    if (!fctOn)                                         // Function OFF: the next ON of this address is a toggle
+    {
+        if (i < addressLearnTableSize)
+            addressLearnOnAddr[i] = 0;
+    }
+    else if (i < addressLearnTableSize)                 // Function already ON for this address: not a toggle
+        return;
+    else if (millis() - addressLearnStartTime < addressLearnSettleMs)
+    {
+        if (freeEntry < addressLearnTableSize)          // Still recording the addresses with the function ON
+            addressLearnOnAddr[freeEntry] = Addr;
+    }
+    else
+        commitLearntAddress(Addr, AddrType);
+}
+
+// Detect the power up pattern arming the learning mode (CV1040 = 2): the learning function toggled from OFF to ON
+// addressLearnArmToggles times on our address within addressLearnArmWindowMs after power up
+void checkAddressLearnArmPattern(FN_GROUP FuncGrp, uint8_t FuncState)
+{
+    uint8_t learnFct = cvValue(cvAddressLearnFct);
+    if (benchmarkRunning || cvValue(cvAddressLearn) != 2 || learnFct >= numberOfFunctions
+        || FuncGrp != funcGroup[learnFct] || millis() > addressLearnArmWindowMs)
+        return;
+
+    if ((FuncState & funcBitMask[learnFct]) && !(funcCache[FuncGrp] & funcBitMask[learnFct]))
+    {
+        if (++addressLearnArmCount >= addressLearnArmToggles)
+            addressLearnArmRequest = true;
+    }
+}
+
 // This callback function is called whenever we receive a DCC Function packet for our address
+// (for all addresses in learning mode)
+// Function changes are applied immediately to the lights, but stored in EEPROM only once confirmed
 void notifyDccFunc(uint16_t Addr, DCC_ADDR_TYPE AddrType, FN_GROUP FuncGrp, uint8_t FuncState)
 {
+    if (addressLearnMode)
+    {
+        learnAddress(Addr, AddrType, FuncGrp, FuncState);
+        return;
+    }
+    if (dccReinitPending)                               // Still receiving the packets for all addresses
+        return;
+    checkAddressLearnArmPattern(FuncGrp, FuncState);
+
     // Check that one of the functions has changed by comparing it to the cache
     if(FuncState != funcCache[FuncGrp])
     {
 #ifdef DEBUG
-        Serial.print("DCC Addr: ");
-        Serial.print(Addr);
-        Serial.print("|Function Group: ");
-        Serial.print(FuncGrp);
-        Serial.print("|State = 0b");
-        Serial.println(FuncState, BIN);
+        if (!benchmarkRunning)
+        {
+            Serial.print("DCC Addr: ");
+            Serial.print(Addr);
+            Serial.print("|Function Group: ");
+            Serial.print(FuncGrp);
+            Serial.print("|State = 0b");
+            Serial.println(FuncState, BIN);
+        }
 #endif
         funcCache[FuncGrp] = FuncState;
+        funcRepeatCount[FuncGrp] = 0;
+        funcChangeTime[FuncGrp] = millis();
         updateLights();
-        EEPROM.put(fctsEepromAddress, funcCache);
     }
+    // Same state as the previous packet, but not yet stored in EEPROM: count the repeats
+    else if (FuncState != funcPersisted[FuncGrp] && funcRepeatCount[FuncGrp] < 255)
+        funcRepeatCount[FuncGrp]++;
+
+    if (funcCache[FuncGrp] != funcPersisted[FuncGrp] && funcRepeatCount[FuncGrp] >= cvValue(cvFuncPersistRepeats))
+        persistFuncGroup(FuncGrp);
+}
+
+// Locate the CV in cvData[]. Return its index, or nrCVs if the CV is unknown
+uint8_t findCV(uint16_t CV)
+{
+    uint8_t i;
+    for (i = 0; i < nrCVs; i++)
+        if (cvData[i].cvNr == CV)
+            break;
+    return i;
 }
 
 // This function is called when the library needs to determine if a CV is valid
@@ -243,15 +587,13 @@ uint8_t notifyCVValid(uint16_t CV, uint8_t Writable)
     Serial.println(Writable);
 #endif
 
-    for (uint8_t i = 0; i < nrCVs; i++)                 // Locate the CV in cvData[]
+    uint8_t i = findCV(CV);                             // Locate the CV in cvData[]
+    if (i < nrCVs)                                      // Found it!
     {
-        if (cvData[i].cvNr == CV)                       // Found it!
-        {
-            if (!Writable)                              // If we just have to check if the CV is readable
-                return (1);                             // Return "yes"
-            else                                        // If we also have to check if the CV is writable
-                return (uint8_t)cvData[i].writable;     // Return the ".writable" data from cvData[]
-        }
+        if (!Writable)                                  // If we just have to check if the CV is readable
+            return (1);                                 // Return "yes"
+        else                                            // If we also have to check if the CV is writable
+            return (uint8_t)cvData[i].writable;         // Return the ".writable" data from cvData[]
     }
     return 0;                                           // If we cannot find the CV, just return "no"
 }
@@ -264,16 +606,14 @@ uint8_t notifyCVRead(uint16_t CV)
     Serial.print(CV);
 #endif
 
-    for (uint8_t i = 0; i < nrCVs; i++)                 // Locate the CV in cvData[]
+    uint8_t i = findCV(CV);                             // Locate the CV in cvData[]
+    if (i < nrCVs)                                      // Found it!
     {
-        if (cvData[i].cvNr == CV)                       // Found it!
-        {
 #ifdef DEBUG
-            Serial.print(" Value: ");
-            Serial.println(cvData[i].value);
+        Serial.print(" Value: ");
+        Serial.println(cvValue(i));
 #endif
-            return cvData[i].value;                     // Return the value stored in the cache
-        }
+        return cvValue(i);                              // Return the value from EEPROM or from the overlay
     }
 #ifdef DEBUG
     Serial.println(" | Unknown CV!!!");
@@ -291,57 +631,45 @@ uint8_t notifyCVWrite(uint16_t CV, uint8_t Value)
     Serial.println(Value);
 #endif
 
-    for (uint8_t i = 0; i < nrCVs; i++)                 // Locate the CV in cvData[]
+    // In learning mode, the decoder receives the operations mode CV writes to all addresses: ignore them
+    if (addressLearnMode || dccReinitPending)
     {
-        if (cvData[i].cvNr == CV)                       // Found it!
-        {
-            if (Value != cvData[i].value)                // If the new value is different than the value stored in cache
-            {
-                EEPROM.write(cvEepromAddress + i, Value);                 // Store the new value in EEPROM
-                cvData[i].value = Value;                //   and in the cache
 #ifdef DEBUG
-                updateCvChecksum();
-                Serial.print("EEPROM.write: i: ");
-                Serial.print(cvEepromAddress + i);
-                Serial.print(" Value: ");
-                Serial.println(Value);
+        Serial.println(" | Ignored in address learning mode");
 #endif
-                updateLights();                         // We update all lights if any CV changes
-            }
-            return Value;                               // Return the value written
-        }
+        return 0;
     }
-#ifdef DEBUG
-    Serial.println(" | Unknown CV!!!");
-#endif
-    return 0;
-}
 
-// Restore all CVs from the EEPROM to the cvData[] cache
-void readCVsToCache()
-{
-    for (uint8_t i = 0; i < nrCVs; i++)
+    uint8_t i = findCV(CV);                             // Locate the CV in cvData[]
+    if (i < nrCVs)                                      // Found it!
     {
-        cvData[i].value = EEPROM.read(cvEepromAddress + i);
+        if (Value != cvValue(i))                        // If the new value is different than the current value
+        {
+            setCVValue(i, Value);                       // Store the new value (committed to EEPROM from loop())
 #ifdef DEBUG
-        Serial.print("EEPROM.read: i: ");
-        Serial.print(cvEepromAddress + i);
-        Serial.print(" Value: ");
-        Serial.println(cvData[i].value);
+            updateCvChecksum();
+            Serial.print("setCVValue: i: ");
+            Serial.print(cvEepromAddress + i);
+            Serial.print(" Value: ");
+            Serial.println(Value);
 #endif
+            if (i == cvTrackVoltage)
+                updateVoltageFactor();
+            updateLights();                             // We update all lights if any CV changes
+        }
+        return Value;                                   // Return the value written
     }
 #ifdef DEBUG
-    if(checkCvChecksum())
-        Serial.println("Checksum correct");
-    else
-        Serial.println("Checksum incorrect!!!!!!!");
+    Serial.println(" | Unknown CV!!!");
 #endif
+    return 0;
 }
 
 // Restore the status of all functions from the EEPROM to the cache
 void readFuncsToCache()
 {
     EEPROM.get(fctsEepromAddress, funcCache);
+    memcpy(funcPersisted, funcCache, sizeof(funcCache));
 }
 
 // Returns true is the function "funcNumber" is on
@@ -399,48 +727,78 @@ const uint8_t coolWhiteLuminanceTable[] = {
   202, 204, 205, 207, 209, 211, 213, 215, 217, 219, 221, 223, 225, 227, 229, 230
 };
 
+// Compute voltageFactor from the track voltage in CV1012
+// Called only at power on and when CV1012 is written, never from updateLights()
+void updateVoltageFactor()
+{
+    uint16_t trackVoltageMv = (uint16_t)cvValue(cvTrackVoltage) * 100;
+
+    if (trackVoltageMv <= ledForwardVoltageMv)
+        voltageFactor = 256;
+    else
+    {
+        uint32_t factor = ((uint32_t)(compensationReferenceMv - ledForwardVoltageMv) << 8) / (trackVoltageMv - ledForwardVoltageMv);
+        voltageFactor = (factor > maxVoltageFactor) ? maxVoltageFactor : factor;
+    }
+}
+
+// Scale a luminance (PWM duty cycle) by the track voltage compensation factor
+// The result is rounded, and a non-zero luminance is never turned into a duty cycle of 0
+inline uint8_t compensateVoltage(uint8_t luminance)
+{
+    uint16_t duty = ((uint16_t)luminance * voltageFactor + 128) >> 8;
+    if (duty > 255)
+        return 255;
+    return (luminance && !duty) ? 1 : duty;
+}
+
 void updateLights()
 {
     uint8_t warmWhiteLEDBrightness, coolWhiteLEDBrightness;
 
     // Process the value of light outputs
     // We use analogWrite() as all output pins support PWM
-    if (checkFunc(cvData[cvLightFctCtrl].value))
+    if (checkFunc(cvValue(cvLightFctCtrl)))
     {
-        if(!cvData[cvLightTest].value)
+        if(!cvValue(cvLightTest))
         {
             // Check if we have to use brightness and CCT parameters set 1 or 2
-            if (cvData[cvLightFctCtrl2].value != 255 && checkFunc(cvData[cvLightFctCtrl2].value))
+            if (cvValue(cvLightFctCtrl2) != 255 && checkFunc(cvValue(cvLightFctCtrl2)))
             {
                 // Use Set 2
                 // Note: C always performs arithmetic operations in the size of the largest involved datatype
                 // Here we cast the operands to uint16_t
-                warmWhiteLEDBrightness = ((uint16_t)cvData[cvLightBrightness2].value * (255 - (uint16_t)cvData[cvLightColorTemperature2].value)) / 256;
-                coolWhiteLEDBrightness = ((uint16_t)cvData[cvLightBrightness2].value * (uint16_t)cvData[cvLightColorTemperature2].value) / 256;
+                warmWhiteLEDBrightness = ((uint16_t)cvValue(cvLightBrightness2) * (255 - (uint16_t)cvValue(cvLightColorTemperature2))) / 256;
+                coolWhiteLEDBrightness = ((uint16_t)cvValue(cvLightBrightness2) * (uint16_t)cvValue(cvLightColorTemperature2)) / 256;
             }
             else
             {
                 // Use Set 1
-                warmWhiteLEDBrightness = ((uint16_t)cvData[cvLightBrightness].value * (255 - (uint16_t)cvData[cvLightColorTemperature].value)) / 256;
-                coolWhiteLEDBrightness = ((uint16_t)cvData[cvLightBrightness].value * (uint16_t)cvData[cvLightColorTemperature].value) / 256;
+                warmWhiteLEDBrightness = ((uint16_t)cvValue(cvLightBrightness) * (255 - (uint16_t)cvValue(cvLightColorTemperature))) / 256;
+                coolWhiteLEDBrightness = ((uint16_t)cvValue(cvLightBrightness) * (uint16_t)cvValue(cvLightColorTemperature)) / 256;
             }
-            analogWrite(pinLight[warmWhiteLight], warmWhiteLuminanceTable[warmWhiteLEDBrightness]);
-            analogWrite(pinLight[coolWhiteLight], coolWhiteLuminanceTable[coolWhiteLEDBrightness]);
+            analogWrite(pinLight[warmWhiteLight], compensateVoltage(warmWhiteLuminanceTable[warmWhiteLEDBrightness]));
+            analogWrite(pinLight[coolWhiteLight], compensateVoltage(coolWhiteLuminanceTable[coolWhiteLEDBrightness]));
 #ifdef DEBUG
-            Serial.print("Writing warmWhiteLEDBrightness: luminance[");
-            Serial.print(warmWhiteLEDBrightness);
-            Serial.print("] = ");
-            Serial.println(warmWhiteLuminanceTable[warmWhiteLEDBrightness]);
-            Serial.print("Writing coolWhiteLEDBrightness: luminance[");
-            Serial.print(coolWhiteLEDBrightness);
-            Serial.print("] = ");
-            Serial.println(coolWhiteLuminanceTable[coolWhiteLEDBrightness]);
+            if (!benchmarkRunning)
+            {
+                Serial.print("Writing warmWhiteLEDBrightness: luminance[");
+                Serial.print(warmWhiteLEDBrightness);
+                Serial.print("] = ");
+                Serial.println(warmWhiteLuminanceTable[warmWhiteLEDBrightness]);
+                Serial.print("Writing coolWhiteLEDBrightness: luminance[");
+                Serial.print(coolWhiteLEDBrightness);
+                Serial.print("] = ");
+                Serial.println(coolWhiteLuminanceTable[coolWhiteLEDBrightness]);
+                Serial.print("Voltage factor: ");
+                Serial.println(voltageFactor);
+            }
 #endif
         }
         else
         {
-            analogWrite(pinLight[warmWhiteLight], cvData[cvLightBrightness].value);
-            analogWrite(pinLight[coolWhiteLight], cvData[cvLightColorTemperature].value);
+            analogWrite(pinLight[warmWhiteLight], cvValue(cvLightBrightness));
+            analogWrite(pinLight[coolWhiteLight], cvValue(cvLightColorTemperature));
         }
     }
     else
@@ -465,6 +823,134 @@ void notifyCVAck(void)
     analogWrite(pinLight[coolWhiteLight], 0);
 }
 
+// Self-benchmark, started by writing 1 to CV1020
+// Each test is timed with TCB1 and the results are stored in the read only CVs CV1021 to CV1030
+// While benchmarkRunning is true, the serial debug messages are suppressed and the function state is not persisted
+const uint8_t benchmarkRuns = 16;
+bool benchmarkRunning = false;
+
+inline void startBenchmarkTimer()
+{
+    TCB1.CTRLA = 0;
+    TCB1.CTRLB = TCB_CNTMODE_INT_gc;                    // Periodic interrupt mode, used as a free-running counter
+    TCB1.CCMP = 0xFFFF;
+    TCB1.CNT = 0;
+    TCB1.CTRLA = TCB_CLKSEL_CLKDIV2_gc | TCB_ENABLE_bm;
+}
+
+// Store a benchmark result in two read only CVs (MSB, LSB)
+void storeBenchmarkResult(uint8_t cvIndexMSB, uint16_t ticks)
+{
+    setCVValue(cvIndexMSB, ticks >> 8);
+    setCVValue(cvIndexMSB + 1, ticks & 0xFF);
+#ifdef DEBUG
+    Serial.print("Benchmark CV");
+    Serial.print(cvData[cvIndexMSB].cvNr);
+    Serial.print(": ");
+    Serial.println(ticks);
+#endif
+}
+
+void runBenchmark()
+{
+    uint16_t start, ticks, minTicks;
+    volatile uint8_t cvFound;
+
+    // Get the address before the benchmark, as notifyCVRead() prints debug messages
+    uint16_t dccAddress = dcc.getAddr();
+    benchmarkRunning = true;
+    startBenchmarkTimer();
+
+    // CV lookup, worst case: the last CV of cvData[]
+    minTicks = 0xFFFF;
+    for (uint8_t run = 0; run < benchmarkRuns; run++)
+    {
+        start = TCB1.CNT;
+        cvFound = findCV(cvData[nrCVs - 1].cvNr);
+        ticks = TCB1.CNT - start;
+        if (ticks < minTicks)
+            minTicks = ticks;
+    }
+    (void)cvFound;
+    storeBenchmarkResult(cvBenchmarkCVLookupMSB, minTicks);
+
+    // updateLights() pipeline, from the CVs and functions to the PWM outputs
+    minTicks = 0xFFFF;
+    for (uint8_t run = 0; run < benchmarkRuns; run++)
+    {
+        start = TCB1.CNT;
+        updateLights();
+        ticks = TCB1.CNT - start;
+        if (ticks < minTicks)
+            minTicks = ticks;
+    }
+    storeBenchmarkResult(cvBenchmarkUpdateLightsMSB, minTicks);
+
+    // EEPROM write latency, including the page erase/write cycle. The location written is the one of the result,
+    // which is overwritten afterwards. The written value is inverted to force a real write
+    uint8_t eepromAddress = cvEepromAddress + cvBenchmarkEepromWriteMSB;
+    flushCVOverlay();
+    waitEepromReady();
+    start = TCB1.CNT;
+    EEPROM.write(eepromAddress, ~EEPROM.read(eepromAddress));
+    waitEepromReady();
+    ticks = TCB1.CNT - start;
+    storeBenchmarkResult(cvBenchmarkEepromWriteMSB, ticks);
+
+    // Packet dispatch. NmraDcc does not allow to inject packets, so the dispatch is timed from notifyDccFunc()
+    // The state of the function filter is saved and restored, so that the synthetic packets leave no trace
+    uint8_t funcState = funcCache[FN_13_20];
+    uint8_t repeatCount = funcRepeatCount[FN_13_20];
+    uint32_t changeTime = funcChangeTime[FN_13_20];
+    uint8_t armCount = addressLearnArmCount;
+
+    // Synthetic function packet repeating the current state of F13-F20, as sent continuously by the command stations
+    minTicks = 0xFFFF;
+    for (uint8_t run = 0; run < benchmarkRuns; run++)
+    {
+        start = TCB1.CNT;
+        notifyDccFunc(dccAddress, DCC_ADDR_SHORT, FN_13_20, funcState);
+        ticks = TCB1.CNT - start;
+        if (ticks < minTicks)
+            minTicks = ticks;
+    }
+    storeBenchmarkResult(cvBenchmarkPacketDispatchMSB, minTicks);
+
+    // Synthetic function packet toggling F13-F20, followed by an untimed packet restoring the state
+    minTicks = 0xFFFF;
+    for (uint8_t run = 0; run < benchmarkRuns; run++)
+    {
+        start = TCB1.CNT;
+        notifyDccFunc(dccAddress, DCC_ADDR_SHORT, FN_13_20, ~funcState);
+        ticks = TCB1.CNT - start;
+        if (ticks < minTicks)
+            minTicks = ticks;
+        notifyDccFunc(dccAddress, DCC_ADDR_SHORT, FN_13_20, funcState);
+    }
+    storeBenchmarkResult(cvBenchmarkPacketChangeMSB, minTicks);
+
+    funcCache[FN_13_20] = funcState;
+    funcRepeatCount[FN_13_20] = repeatCount;
+    funcChangeTime[FN_13_20] = changeTime;
+    addressLearnArmCount = armCount;
+
+    TCB1.CTRLA = 0;                                     // Stop TCB1
+    benchmarkRunning = false;
+    updateLights();
+
+    // Benchmark done: reset CV1020
+    notifyCVWrite(cvData[cvBenchmark].cvNr, 0);
+}
+
+// Initialize the NmraDcc library
+// void NmraDcc::init (uint8_t ManufacturerId, uint8_t VersionId, uint8_t Flags, uint8_t OpsModeAddressBaseCV)
+// COMMIT_NUMBER is defined in version.h
+// In address learning mode, FLAGS_MY_ADDRESS_ONLY is not set, to receive the packets for all addresses
+void initDcc()
+{
+    dcc.init(MAN_ID_DIY, COMMIT_COUNT, (addressLearnMode ? 0 : FLAGS_MY_ADDRESS_ONLY) | FLAGS_AUTO_FACTORY_DEFAULT, 0);
+}
+
 void setup()
 {
     // Set light pins to outputs
@@ -506,11 +992,18 @@ void setup()
     }
 #endif
 
-    // Retrieve the state of DCC functions and DCC CVs from the EEPROM to the cache
+    // Retrieve the state of DCC functions from the EEPROM to the cache
+    // CVs are read directly from the mapped EEPROM and need no copy
     readFuncsToCache();
-    readCVsToCache();
+#ifdef DEBUG
+    if(checkCvChecksum())
+        Serial.println("Checksum correct");
+    else
+        Serial.println("Checksum incorrect!!!!!!!");
+#endif
+    updateVoltageFactor();
 
-    // Compute the brightness of all lights from the CVs in cache
+    // Compute the brightness of all lights from the CVs
     updateLights(); 
 
     // Pause after boot before processing DCC messages, trying to avoid the service mode
@@ -519,10 +1012,8 @@ void setup()
 
     // Initialize the NmraDcc library
     // void NmraDcc::pin (uint8_t ExtIntPinNum, uint8_t EnablePullup)
-    // void NmraDcc::init (uint8_t ManufacturerId, uint8_t VersionId, uint8_t Flags, uint8_t OpsModeAddressBaseCV)
-    // COMMIT_NUMBER is defined in version.h
     dcc.pin(pinDCCInput, false);
-    dcc.init(MAN_ID_DIY, COMMIT_COUNT, FLAGS_MY_ADDRESS_ONLY | FLAGS_AUTO_FACTORY_DEFAULT, 0);
+    initDcc();
 
     // Commented out as not necessary. Uncomment for debugging purposes only. notifyCVResetFactoryDefault() is
     // automatically called at the very first call (i.e. unprogrammed EEPROM) of
@@ -559,6 +1050,50 @@ void loop()
     // Process DCC packets
     dcc.process();
 
+    // Commit the pending CV writes to EEPROM
+    commitCVOverlay();
+
+    // The checks below read CVs from the mapped EEPROM: skip them while an EEPROM write is in progress, so that
+    // loop() never waits for the EEPROM
+    if (!eepromBusy())
+    {
+        // Store in EEPROM the function changes that have been stable for the delay in CV1014
+        if (cvValue(cvFuncPersistDelay))
+        {
+            for (uint8_t funcGrp = FN_0_4; funcGrp < numberOfFunctionGroups; funcGrp++)
+                if (funcCache[funcGrp] != funcPersisted[funcGrp]
+                    && millis() - funcChangeTime[funcGrp] >= (uint32_t)cvValue(cvFuncPersistDelay) * 100)
+                    persistFuncGroup(funcGrp);
+        }
+    }
+
+    if (!eepromBusy())                                  // persistFuncGroup() may have started a write
+    {
+        // Arm the address learning mode when requested by a write to CV1040 or by the power up pattern
+        if ((cvValue(cvAddressLearn) == 1 || addressLearnArmRequest) && !addressLearnMode && !dccReinitPending)
+            startAddressLearning();
+    }
+
+    // Leave the learning mode if no address has been learnt in time
+    if (addressLearnMode && millis() - addressLearnStartTime >= addressLearnTimeoutMs)
+    {
+#ifdef DEBUG
+        Serial.println("Address learning timeout");
+#endif
+        endAddressLearning();
+    }
+
+    // Back to our address only when the learning mode ends. This also clears the address cached by NmraDcc
+    if (dccReinitPending)
+    {
+        dccReinitPending = false;
+        initDcc();
+    }
+
+    // Run the self-benchmark when requested by a write to CV1020
+    if (!eepromBusy() && cvValue(cvBenchmark) && !factoryDefaultCVIndex && !addressLearnMode)
+        runBenchmark();
+
     // Handle resetting CVs to Factory Defaults
     if (factoryDefaultCVIndex && dcc.isSetCVReady())
     {